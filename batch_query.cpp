@@ -0,0 +1,152 @@
+#include "batch_query.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <Jolt/Physics/Collision/CollisionCollectorImpl.h>
+
+// Spread the lower 10 bits of v so there are two zero bits between each
+static uint32_t spread_bits_10(uint32_t v) {
+  v &= 0x3ff;
+  v = (v | (v << 16)) & 0x030000ff;
+  v = (v | (v << 8)) & 0x0300f00f;
+  v = (v | (v << 4)) & 0x030c30c3;
+  v = (v | (v << 2)) & 0x09249249;
+  return v;
+}
+
+// Returns the query indices [0, count), ordered along a 30-bit Morton curve
+// through midpoint(i) and quantized against the combined bounds when sorting.
+// Without sorting this is the identity order and midpoint is never called.
+template <class MidpointFn>
+static std::vector<JPH::uint> morton_order(JPH::uint count,
+                                           bool sort_spatially,
+                                           const MidpointFn& midpoint) {
+  std::vector<JPH::uint> order(count);
+  for (JPH::uint i = 0; i < count; i++) {
+    order[i] = i;
+  }
+  if (!sort_spatially || count < 2) {
+    return order;
+  }
+
+  std::vector<JPH::Vec3> points(count);
+  JPH::Vec3 p_min = JPH::Vec3::sReplicate(FLT_MAX);
+  JPH::Vec3 p_max = JPH::Vec3::sReplicate(-FLT_MAX);
+  for (JPH::uint i = 0; i < count; i++) {
+    points[i] = midpoint(i);
+    p_min = JPH::Vec3::sMin(p_min, points[i]);
+    p_max = JPH::Vec3::sMax(p_max, points[i]);
+  }
+  const JPH::Vec3 extent =
+      JPH::Vec3::sMax(p_max - p_min, JPH::Vec3::sReplicate(1.0e-6f));
+  const JPH::Vec3 scale = JPH::Vec3::sReplicate(1023.0f) / extent;
+
+  std::vector<std::pair<uint32_t, JPH::uint>> keys(count);
+  for (JPH::uint i = 0; i < keys.size(); i++) {
+    const JPH::Vec3 q = (points[i] - p_min) * scale;
+    const uint32_t code =
+        spread_bits_10(static_cast<uint32_t>(q.GetX())) |
+        (spread_bits_10(static_cast<uint32_t>(q.GetY())) << 1) |
+        (spread_bits_10(static_cast<uint32_t>(q.GetZ())) << 2);
+    keys[i] = {code, i};
+  }
+  std::sort(keys.begin(), keys.end());
+  for (JPH::uint i = 0; i < keys.size(); i++) {
+    order[i] = keys[i].second;
+  }
+  return order;
+}
+
+// Calls fn(begin, end) for contiguous ranges covering [0, count), as jobs on
+// job_system when there is enough work, and waits for all of them
+template <class Fn>
+static void run_in_jobs(JPH::JobSystem* job_system, JPH::uint count,
+                        const BatchQuerySettings& batch_settings,
+                        const Fn& fn) {
+  const JPH::uint min_per_job =
+      std::max<JPH::uint>(batch_settings.min_queries_per_job, 1);
+  if (job_system == nullptr || count <= min_per_job) {
+    fn(0, count);
+    return;
+  }
+
+  const JPH::uint max_jobs = std::max<JPH::uint>(
+      job_system->GetMaxConcurrency() * batch_settings.jobs_per_thread, 1);
+  const JPH::uint num_jobs =
+      std::min<JPH::uint>(max_jobs, (count + min_per_job - 1) / min_per_job);
+  const JPH::uint per_job = (count + num_jobs - 1) / num_jobs;
+
+  JPH::JobSystem::Barrier* barrier = job_system->CreateBarrier();
+  for (JPH::uint begin = 0; begin < count; begin += per_job) {
+    const JPH::uint end = std::min(begin + per_job, count);
+    JPH::JobSystem::JobHandle handle = job_system->CreateJob(
+        "BatchQuery", JPH::Color::sGreen, [&fn, begin, end]() {
+          fn(begin, end);
+        });
+    barrier->AddJob(handle);
+  }
+  job_system->WaitForJobs(barrier);
+  job_system->DestroyBarrier(barrier);
+}
+
+void batch_cast_ray(const JPH::NarrowPhaseQuery& narrow_phase_query,
+                    const JPH::RRayCast* rays, JPH::uint num_rays,
+                    JPH::RayCastResult* out_hits, JPH::JobSystem* job_system,
+                    const BatchQuerySettings& batch_settings,
+                    const JPH::BroadPhaseLayerFilter& broad_phase_layer_filter,
+                    const JPH::ObjectLayerFilter& object_layer_filter,
+                    const JPH::BodyFilter& body_filter) {
+  const std::vector<JPH::uint> order = morton_order(
+      num_rays, batch_settings.sort_spatially, [rays](JPH::uint i) {
+        return JPH::Vec3(rays[i].mOrigin + 0.5f * rays[i].mDirection);
+      });
+
+  run_in_jobs(job_system, num_rays, batch_settings,
+              [&](JPH::uint begin, JPH::uint end) {
+                for (JPH::uint i = begin; i < end; i++) {
+                  const JPH::uint index = order[i];
+                  JPH::RayCastResult& hit = out_hits[index];
+                  hit = JPH::RayCastResult();
+                  narrow_phase_query.CastRay(
+                      rays[index], hit, broad_phase_layer_filter,
+                      object_layer_filter, body_filter);
+                }
+              });
+}
+
+void batch_cast_shape(
+    const JPH::NarrowPhaseQuery& narrow_phase_query,
+    const JPH::RShapeCast* casts, JPH::uint num_casts,
+    const JPH::ShapeCastSettings& shape_cast_settings,
+    JPH::ShapeCastResult* out_hits, JPH::JobSystem* job_system,
+    const BatchQuerySettings& batch_settings,
+    const JPH::BroadPhaseLayerFilter& broad_phase_layer_filter,
+    const JPH::ObjectLayerFilter& object_layer_filter,
+    const JPH::BodyFilter& body_filter, const JPH::ShapeFilter& shape_filter) {
+  const std::vector<JPH::uint> order = morton_order(
+      num_casts, batch_settings.sort_spatially, [casts](JPH::uint i) {
+        return JPH::Vec3(casts[i].mCenterOfMassStart.GetTranslation() +
+                         0.5f * casts[i].mDirection);
+      });
+
+  run_in_jobs(
+      job_system, num_casts, batch_settings,
+      [&](JPH::uint begin, JPH::uint end) {
+        for (JPH::uint i = begin; i < end; i++) {
+          const JPH::uint index = order[i];
+          const JPH::RShapeCast& shape_cast = casts[index];
+          JPH::ClosestHitCollisionCollector<JPH::CastShapeCollector> collector;
+          narrow_phase_query.CastShape(
+              shape_cast, shape_cast_settings,
+              shape_cast.mCenterOfMassStart.GetTranslation(), collector,
+              broad_phase_layer_filter, object_layer_filter, body_filter,
+              shape_filter);
+          out_hits[index] =
+              collector.HadHit() ? collector.mHit : JPH::ShapeCastResult();
+        }
+      });
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <Jolt/Jolt.h>
+
+#include <Jolt/Core/JobSystem.h>
+#include <Jolt/Physics/Collision/NarrowPhaseQuery.h>
+#include <Jolt/Physics/Collision/RayCast.h>
+#include <Jolt/Physics/Collision/ShapeCast.h>
+
+// ============= Batched ray and shape-cast queries on top of NarrowPhaseQuery
+//
+// Queries are reordered along a Morton curve through their midpoints so that
+// neighbouring queries touch the same broad phase nodes and mesh BVH nodes,
+// then split into contiguous chunks that run as jobs on the given job system.
+// Results are written to the caller's arrays at the index of the originating
+// query, so the reordering is invisible to the caller.
+//
+// Passing a null job system (or a batch smaller than one job) runs the whole
+// batch on the calling thread.
+
+struct BatchQuerySettings {
+  // Smallest number of queries handed to a single job; below this the job
+  // overhead outweighs the work
+  JPH::uint min_queries_per_job = 64;
+  // Number of jobs created per unit of job system concurrency, so that uneven
+  // chunks still balance across threads
+  JPH::uint jobs_per_thread = 4;
+  // Reorder queries spatially before dispatching them
+  bool sort_spatially = true;
+};
+
+// Casts num_rays rays and stores the closest hit of ray i in out_hits[i]. A
+// ray without a hit gets a default RayCastResult (invalid mBodyID).
+void batch_cast_ray(
+    const JPH::NarrowPhaseQuery& narrow_phase_query,
+    const JPH::RRayCast* rays, JPH::uint num_rays,
+    JPH::RayCastResult* out_hits, JPH::JobSystem* job_system,
+    const BatchQuerySettings& batch_settings = {},
+    const JPH::BroadPhaseLayerFilter& broad_phase_layer_filter = {},
+    const JPH::ObjectLayerFilter& object_layer_filter = {},
+    const JPH::BodyFilter& body_filter = {});
+
+// Casts num_casts shapes and stores the closest hit of cast i in out_hits[i].
+// A cast without a hit gets a default ShapeCastResult (invalid mBodyID2).
+// Each cast uses its own start position as base offset.
+void batch_cast_shape(
+    const JPH::NarrowPhaseQuery& narrow_phase_query,
+    const JPH::RShapeCast* casts, JPH::uint num_casts,
+    const JPH::ShapeCastSettings& shape_cast_settings,
+    JPH::ShapeCastResult* out_hits, JPH::JobSystem* job_system,
+    const BatchQuerySettings& batch_settings = {},
+    const JPH::BroadPhaseLayerFilter& broad_phase_layer_filter = {},
+    const JPH::ObjectLayerFilter& object_layer_filter = {},
+    const JPH::BodyFilter& body_filter = {},
+    const JPH::ShapeFilter& shape_filter = {});
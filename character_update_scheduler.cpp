@@ -0,0 +1,227 @@
+#include "character_update_scheduler.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <utility>
+
+#include <Jolt/Geometry/AABox.h>
+#include <Jolt/Physics/Collision/BroadPhase/BroadPhaseQuery.h>
+#include <Jolt/Physics/Collision/CollisionCollectorImpl.h>
+
+namespace {
+
+// Collects until the first body that is awake; sleeping bodies cannot push
+// into a character
+class ActiveBodyCollector : public JPH::CollideShapeBodyCollector {
+ public:
+  explicit ActiveBodyCollector(const JPH::BodyInterface& body_interface)
+      : body_interface_(body_interface) {}
+
+  virtual void AddHit(const JPH::BodyID& body_id) override {
+    if (body_interface_.IsActive(body_id)) {
+      had_hit_ = true;
+      ForceEarlyOut();
+    }
+  }
+
+  bool had_hit() const { return had_hit_; }
+
+ private:
+  const JPH::BodyInterface& body_interface_;
+  bool had_hit_ = false;
+};
+
+// Requested velocity relative to the ground, with the part along up removed
+JPH::Vec3 get_horizontal_velocity(const JPH::CharacterVirtual& character) {
+  const JPH::Vec3 up = character.GetUp();
+  const JPH::Vec3 relative_velocity =
+      character.GetLinearVelocity() - character.GetGroundVelocity();
+  return relative_velocity - relative_velocity.Dot(up) * up;
+}
+
+}  // namespace
+
+CharacterUpdateScheduler::CharacterUpdateScheduler(
+    const JPH::PhysicsSystem& physics_system,
+    const JPH::BroadPhaseLayerFilter& dynamic_broad_phase_layer_filter,
+    const JPH::ObjectLayerFilter& dynamic_object_layer_filter,
+    const CharacterUpdateSchedulerSettings& settings)
+    : physics_system_(physics_system),
+      dynamic_broad_phase_layer_filter_(dynamic_broad_phase_layer_filter),
+      dynamic_object_layer_filter_(dynamic_object_layer_filter),
+      settings_(settings) {
+  settings_.reduced_interval =
+      std::max<JPH::uint>(settings_.reduced_interval, 1);
+}
+
+void CharacterUpdateScheduler::add_character(
+    JPH::CharacterVirtual* character) {
+  JPH_ASSERT(entry_index_.count(character) == 0);
+  Entry entry;
+  entry.character = character;
+  entry.slot = next_slot_++;
+  entry.last_horizontal_velocity = get_horizontal_velocity(*character);
+  entry.last_ground_state = character->GetGroundState();
+  entry_index_[character] = static_cast<JPH::uint>(entries_.size());
+  entries_.push_back(entry);
+}
+
+void CharacterUpdateScheduler::remove_character(
+    JPH::CharacterVirtual* character) {
+  const auto it = entry_index_.find(character);
+  if (it == entry_index_.end()) {
+    return;
+  }
+
+  // Move the last entry into the hole so removal is O(1)
+  const JPH::uint index = it->second;
+  entry_index_.erase(it);
+  if (index + 1 != entries_.size()) {
+    entries_[index] = std::move(entries_.back());
+    entry_index_[entries_[index].character.GetPtr()] = index;
+  }
+  entries_.pop_back();
+}
+
+void CharacterUpdateScheduler::set_interest_points(
+    std::vector<JPH::RVec3> interest_points) {
+  interest_points_ = std::move(interest_points);
+}
+
+CharacterUpdateTier CharacterUpdateScheduler::get_tier(
+    const JPH::CharacterVirtual* character) const {
+  const auto it = entry_index_.find(character);
+  if (it == entry_index_.end()) {
+    JPH_ASSERT(false);
+    return CharacterUpdateTier::kEveryFrame;
+  }
+  return entries_[it->second].tier;
+}
+
+bool CharacterUpdateScheduler::has_nearby_dynamic_body(
+    const JPH::CharacterVirtual& character) const {
+  JPH::AABox bounds = character.GetShape()->GetWorldSpaceBounds(
+      character.GetCenterOfMassTransform(), JPH::Vec3::sReplicate(1.0f));
+  bounds.ExpandBy(JPH::Vec3::sReplicate(settings_.dynamic_body_distance));
+  ActiveBodyCollector collector(physics_system_.GetBodyInterfaceNoLock());
+  physics_system_.GetBroadPhaseQuery().CollideAABox(
+      bounds, collector, dynamic_broad_phase_layer_filter_,
+      dynamic_object_layer_filter_);
+  return collector.had_hit();
+}
+
+CharacterUpdateTier CharacterUpdateScheduler::compute_desired_tier(
+    const Entry& entry) const {
+  const JPH::CharacterVirtual& character = *entry.character;
+
+  // Something may push into the character, so it cannot be left behind
+  if (has_nearby_dynamic_body(character)) {
+    return CharacterUpdateTier::kEveryFrame;
+  }
+
+  // Standing still on non-moving ground with the same input as last frame: an
+  // update would not change anything. Callers usually add gravity to the
+  // requested velocity even on ground, so only the part of the velocity
+  // relative to the ground and perpendicular to up counts, and along up the
+  // character must merely not move away from the ground.
+  const float idle_speed_sq = settings_.idle_speed * settings_.idle_speed;
+  const auto ground_state = character.GetGroundState();
+  if (ground_state == JPH::CharacterVirtual::EGroundState::OnGround &&
+      ground_state == entry.last_ground_state &&
+      character.GetGroundVelocity().LengthSq() < idle_speed_sq) {
+    const float up_speed =
+        (character.GetLinearVelocity() - character.GetGroundVelocity())
+            .Dot(character.GetUp());
+    const JPH::Vec3 horizontal_velocity = get_horizontal_velocity(character);
+    if (up_speed < settings_.idle_speed &&
+        horizontal_velocity.LengthSq() < idle_speed_sq &&
+        (horizontal_velocity - entry.last_horizontal_velocity).LengthSq() <
+            idle_speed_sq) {
+      return CharacterUpdateTier::kIdle;
+    }
+  }
+
+  if (!interest_points_.empty()) {
+    float min_distance_sq = FLT_MAX;
+    const JPH::RVec3 position = character.GetPosition();
+    for (const auto& p_interest : interest_points_) {
+      min_distance_sq = std::min(
+          min_distance_sq,
+          static_cast<float>((p_interest - position).LengthSq()));
+    }
+    if (min_distance_sq >
+        settings_.reduced_distance * settings_.reduced_distance) {
+      return CharacterUpdateTier::kReduced;
+    }
+  }
+
+  return CharacterUpdateTier::kEveryFrame;
+}
+
+void CharacterUpdateScheduler::update(
+    float delta_time, JPH::Vec3Arg gravity,
+    const JPH::CharacterVirtual::ExtendedUpdateSettings& settings,
+    const JPH::BroadPhaseLayerFilter& broad_phase_layer_filter,
+    const JPH::ObjectLayerFilter& object_layer_filter,
+    const JPH::BodyFilter& body_filter, const JPH::ShapeFilter& shape_filter,
+    JPH::TempAllocator& temp_allocator) {
+  counters_.fill({});
+
+  for (auto& entry : entries_) {
+    // Promote right away, demote only after qualifying for a while
+    const CharacterUpdateTier desired_tier = compute_desired_tier(entry);
+    if (desired_tier < entry.tier) {
+      entry.tier = desired_tier;
+      entry.frames_qualified_for_demotion = 0;
+    } else if (desired_tier > entry.tier) {
+      entry.frames_qualified_for_demotion++;
+      if (entry.frames_qualified_for_demotion >=
+          settings_.frames_before_demotion) {
+        entry.tier = desired_tier;
+        entry.frames_qualified_for_demotion = 0;
+      }
+    } else {
+      entry.frames_qualified_for_demotion = 0;
+    }
+
+    JPH::CharacterVirtual& character = *entry.character;
+    entry.last_horizontal_velocity = get_horizontal_velocity(character);
+    entry.last_ground_state = character.GetGroundState();
+
+    bool do_update = false;
+    float update_delta_time = entry.pending_delta_time + delta_time;
+    switch (entry.tier) {
+      case CharacterUpdateTier::kEveryFrame:
+        do_update = true;
+        break;
+      case CharacterUpdateTier::kReduced:
+        do_update =
+            (frame_index_ + entry.slot) % settings_.reduced_interval == 0;
+        break;
+      case CharacterUpdateTier::kIdle:
+        // Nothing happens while idle, so this frame's time is dropped. Time
+        // left over from kReduced still has to be simulated once.
+        do_update = entry.pending_delta_time > 0.0f;
+        update_delta_time = entry.pending_delta_time;
+        break;
+    }
+
+    auto& counters = counters_[static_cast<JPH::uint>(entry.tier)];
+    counters.num_characters++;
+    if (!do_update) {
+      if (entry.tier != CharacterUpdateTier::kIdle) {
+        entry.pending_delta_time += delta_time;
+      }
+      counters.num_skipped++;
+      continue;
+    }
+
+    character.ExtendedUpdate(update_delta_time, gravity, settings,
+                             broad_phase_layer_filter, object_layer_filter,
+                             body_filter, shape_filter, temp_allocator);
+    entry.pending_delta_time = 0.0f;
+    counters.num_updated++;
+  }
+
+  frame_index_++;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <array>
+#include <unordered_map>
+#include <vector>
+
+#include <Jolt/Jolt.h>
+
+#include <Jolt/Core/TempAllocator.h>
+#include <Jolt/Physics/Character/CharacterVirtual.h>
+#include <Jolt/Physics/PhysicsSystem.h>
+
+// ============= Level-of-detail scheduling of CharacterVirtual updates
+//
+// Each frame every character is assigned to a tier:
+// - kEveryFrame: an active dynamic body is near the character's shape, or the
+//   character is moving close to an interest point. Updated every frame.
+// - kReduced: moving, but far from every interest point. Updated every Nth
+//   frame with the delta time accumulated since its last update.
+// - kIdle: on non-moving ground, requesting (almost) no velocity along the
+//   ground and none away from it, with the same requested velocity along the
+//   ground and the same ground state as last frame. Not updated at all, apart
+//   from one update that catches up on time left over from kReduced.
+//
+// Promotion to a more frequent tier is immediate; demotion waits until the
+// character has qualified for the less frequent tier for a number of frames,
+// so characters do not flicker between tiers.
+//
+// The scheduler holds a reference to every added character, so characters
+// stay alive until they are removed or the scheduler is destroyed. update()
+// reads body activity through PhysicsSystem::GetBodyInterfaceNoLock(), so it
+// must not run concurrently with PhysicsSystem::Update().
+
+enum class CharacterUpdateTier { kEveryFrame, kReduced, kIdle };
+
+static constexpr JPH::uint kNumCharacterUpdateTiers = 3;
+
+struct CharacterUpdateSchedulerSettings {
+  // kReduced characters are updated every this many frames
+  JPH::uint reduced_interval = 4;
+  // Characters farther than this from all interest points may be kReduced
+  float reduced_distance = 30.0f;
+  // Active bodies within this distance of the character's shape keep it at
+  // kEveryFrame
+  float dynamic_body_distance = 3.0f;
+  // Speed along the ground (and ground speed) below which a character may be
+  // kIdle
+  float idle_speed = 0.01f;
+  // Consecutive frames a character must qualify for a less frequent tier
+  // before it is demoted
+  JPH::uint frames_before_demotion = 10;
+};
+
+// Per-tier counters of the last call to CharacterUpdateScheduler::update()
+struct CharacterUpdateTierCounters {
+  // Characters assigned to the tier
+  JPH::uint num_characters = 0;
+  // Characters of the tier that got an ExtendedUpdate
+  JPH::uint num_updated = 0;
+  // Characters of the tier that were skipped
+  JPH::uint num_skipped = 0;
+};
+
+class CharacterUpdateScheduler {
+ public:
+  // Bodies passing the given filters count as "nearby dynamic bodies". The
+  // filters must outlive the scheduler.
+  CharacterUpdateScheduler(
+      const JPH::PhysicsSystem& physics_system,
+      const JPH::BroadPhaseLayerFilter& dynamic_broad_phase_layer_filter,
+      const JPH::ObjectLayerFilter& dynamic_object_layer_filter,
+      const CharacterUpdateSchedulerSettings& settings = {});
+
+  // New characters start at kEveryFrame. The scheduler shares ownership of
+  // the character until remove_character(). Adding a character twice is not
+  // allowed.
+  void add_character(JPH::CharacterVirtual* character);
+  // O(1); removing a character that was never added does nothing
+  void remove_character(JPH::CharacterVirtual* character);
+
+  // Positions of observers (players, cameras). With no interest points, every
+  // character counts as near.
+  void set_interest_points(std::vector<JPH::RVec3> interest_points);
+
+  // Assigns tiers and runs ExtendedUpdate on the characters that are due this
+  // frame. Call once per frame after setting each character's requested
+  // linear velocity, in place of calling ExtendedUpdate on every character.
+  void update(float delta_time, JPH::Vec3Arg gravity,
+              const JPH::CharacterVirtual::ExtendedUpdateSettings& settings,
+              const JPH::BroadPhaseLayerFilter& broad_phase_layer_filter,
+              const JPH::ObjectLayerFilter& object_layer_filter,
+              const JPH::BodyFilter& body_filter,
+              const JPH::ShapeFilter& shape_filter,
+              JPH::TempAllocator& temp_allocator);
+
+  // O(1) lookup. The character must have been added; otherwise this asserts
+  // and, with asserts disabled, returns kEveryFrame.
+  CharacterUpdateTier get_tier(const JPH::CharacterVirtual* character) const;
+  const CharacterUpdateTierCounters& get_counters(
+      CharacterUpdateTier tier) const {
+    return counters_[static_cast<JPH::uint>(tier)];
+  }
+
+ private:
+  struct Entry {
+    JPH::Ref<JPH::CharacterVirtual> character;
+    CharacterUpdateTier tier = CharacterUpdateTier::kEveryFrame;
+    // Offsets kReduced updates so they spread over the interval
+    JPH::uint slot = 0;
+    JPH::uint frames_qualified_for_demotion = 0;
+    // Simulated time not yet passed to ExtendedUpdate
+    float pending_delta_time = 0.0f;
+    // Requested velocity relative to the ground with the part along up
+    // removed, as of the last update() call
+    JPH::Vec3 last_horizontal_velocity = JPH::Vec3::sZero();
+    JPH::CharacterVirtual::EGroundState last_ground_state =
+        JPH::CharacterVirtual::EGroundState::InAir;
+  };
+
+  CharacterUpdateTier compute_desired_tier(const Entry& entry) const;
+  bool has_nearby_dynamic_body(const JPH::CharacterVirtual& character) const;
+
+  const JPH::PhysicsSystem& physics_system_;
+  const JPH::BroadPhaseLayerFilter& dynamic_broad_phase_layer_filter_;
+  const JPH::ObjectLayerFilter& dynamic_object_layer_filter_;
+  CharacterUpdateSchedulerSettings settings_;
+
+  std::vector<Entry> entries_;
+  std::unordered_map<const JPH::CharacterVirtual*, JPH::uint> entry_index_;
+  std::vector<JPH::RVec3> interest_points_;
+  JPH::uint frame_index_ = 0;
+  JPH::uint next_slot_ = 0;
+  std::array<CharacterUpdateTierCounters, kNumCharacterUpdateTiers> counters_;
+};
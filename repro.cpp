@@ -1,24 +1,34 @@
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <ostream>
+#include <random>
 #include <thread>
 
 #include <Jolt/Jolt.h>
 
 #include <Jolt/Core/Factory.h>
 #include <Jolt/Core/JobSystemSingleThreaded.h>
+#include <Jolt/Core/JobSystemThreadPool.h>
 #include <Jolt/Core/TempAllocator.h>
 #include <Jolt/Physics/Body/BodyCreationSettings.h>
 #include <Jolt/Physics/Character/CharacterVirtual.h>
 #include <Jolt/Physics/Collision/BroadPhase/BroadPhaseLayer.h>
+#include <Jolt/Physics/Collision/CollisionCollectorImpl.h>
 #include <Jolt/Physics/Collision/ObjectLayer.h>
+#include <Jolt/Physics/Collision/Shape/BoxShape.h>
 #include <Jolt/Physics/Collision/Shape/CapsuleShape.h>
 #include <Jolt/Physics/Collision/Shape/MeshShape.h>
 #include <Jolt/Physics/Collision/Shape/RotatedTranslatedShape.h>
+#include <Jolt/Physics/Collision/Shape/SphereShape.h>
 #include <Jolt/Physics/PhysicsSettings.h>
 #include <Jolt/Physics/PhysicsSystem.h>
 #include <Jolt/RegisterTypes.h>
 
+#include "batch_query.h"
+#include "character_update_scheduler.h"
+
 // JPH_SUPPRESS_WARNINGS
 
 // ============= The test data and constants (using Z-up orientation!)
@@ -587,9 +597,493 @@ class ObjectVsBroadPhaseLayerFilterImpl
   }
 };
 
+// Character controller repro
+
+void run_character_simulation(JPH::PhysicsSystem& physics_system,
+                              JPH::TempAllocator& temp_allocator,
+                              JPH::JobSystem& job_system) {
+  // Set up controller
+  JPH::Ref<JPH::CharacterVirtual> character_virtual;
+  {
+    auto settings = test_character_virtual_settings();
+    character_virtual = new JPH::CharacterVirtual(
+        settings, test_character_position_initial(), JPH::Quat::sIdentity(),
+        &physics_system);
+  }
+
+  // Run simulation for a while
+  JPH::Vec3 p_last = character_virtual->GetPosition();
+  float max_length_delta = 0.0f;
+  const size_t kMaxNumSteps = 100;
+  for (size_t num_steps = 0; num_steps < kMaxNumSteps; num_steps++) {
+    const auto p_this = character_virtual->GetPosition();
+    const auto delta = p_this - p_last;
+    p_last = p_this;
+    const float length_delta = delta.Length();
+    if (length_delta > max_length_delta) {
+      max_length_delta = length_delta;
+    }
+    const char* prefix = length_delta > 0.3f ? ">" : " ";
+    std::cout << prefix << " pos.xy: (" << p_this.GetX() << ", "
+              << p_this.GetY() << ")" << " delta.xy: (" << delta.GetX() << ", "
+              << delta.GetY() << ")" << std::endl;
+
+    const float delta_time = test_delta_time();
+    test_character_set_linear_velocity(character_virtual, delta_time);
+    character_virtual->ExtendedUpdate(
+        delta_time, physics_system.GetGravity(),
+        test_extended_update_settings(),
+        physics_system.GetDefaultBroadPhaseLayerFilter(
+            ObjectLayerImpl::kDynamic),
+        physics_system.GetDefaultLayerFilter(ObjectLayerImpl::kDynamic), {},
+        {}, temp_allocator);
+
+    const JPH::uint kCollisionSteps = 1;
+    physics_system.Update(delta_time, kCollisionSteps, &temp_allocator,
+                          &job_system);
+  }
+  std::cout << std::endl << "max delta: " << max_length_delta << std::endl;
+
+  // Tear down controller -- handled by Ref*
+}
+
+// Batch query benchmark (run with --bench-batch-query)
+
+// Random line-of-sight rays and short capsule casts over the test meshes,
+// timed as one-at-a-time NarrowPhaseQuery calls and through batch_query.h
+// with and without spatial sorting, on the calling thread and on a thread
+// pool. Results of every batched run must match the one-at-a-time run, and
+// both query kinds must hit something. Returns false if any check fails.
+bool run_batch_query_benchmark(const JPH::PhysicsSystem& physics_system) {
+  const JPH::uint kNumRays = 50000;
+  const JPH::uint kNumCasts = 5000;
+  const JPH::uint kNumIterations = 10;
+  const float kCastLength = 1.0f;
+
+  // Nothing is simulating, so skip body locking like a query phase would
+  const JPH::NarrowPhaseQuery& narrow_phase_query =
+      physics_system.GetNarrowPhaseQueryNoLock();
+  const auto bplf =
+      physics_system.GetDefaultBroadPhaseLayerFilter(ObjectLayerImpl::kDynamic);
+  const auto olf =
+      physics_system.GetDefaultLayerFilter(ObjectLayerImpl::kDynamic);
+
+  // Queries between random points above the ground plane
+  std::mt19937 rng(940);
+  std::uniform_real_distribution<float> dist_x(-27.0f, 90.0f);
+  std::uniform_real_distribution<float> dist_y(-40.0f, 40.0f);
+  std::uniform_real_distribution<float> dist_z(0.5f, 8.0f);
+  std::uniform_real_distribution<float> dist_angle(0.0f, 2.0f * JPH::JPH_PI);
+  auto random_point = [&]() {
+    return JPH::RVec3(dist_x(rng), dist_y(rng), dist_z(rng));
+  };
+
+  std::vector<JPH::RRayCast> vec_ray(kNumRays);
+  for (auto& ray : vec_ray) {
+    const JPH::RVec3 p_eye = random_point();
+    ray = JPH::RRayCast{p_eye, JPH::Vec3(random_point() - p_eye)};
+  }
+
+  const JPH::RefConst<JPH::Shape> shape_player =
+      test_character_virtual_settings()->mShape;
+  std::vector<JPH::RShapeCast> vec_cast;
+  vec_cast.reserve(kNumCasts);
+  for (JPH::uint i = 0; i < kNumCasts; i++) {
+    const float angle = dist_angle(rng);
+    const JPH::Vec3 direction =
+        kCastLength * JPH::Vec3(JPH::Cos(angle), JPH::Sin(angle), 0.0f);
+    JPH::RVec3 p_start = random_point();
+    p_start.SetZ(0.1f);
+    vec_cast.push_back(JPH::RShapeCast::sFromWorldTransform(
+        shape_player, JPH::Vec3::sReplicate(1.0f),
+        JPH::RMat44::sTranslation(p_start), direction));
+  }
+  JPH::ShapeCastSettings shape_cast_settings;
+  shape_cast_settings.mUseShrunkenShapeAndConvexRadius = true;
+
+  const JPH::uint num_threads =
+      std::max(std::thread::hardware_concurrency(), 1u) - 1;
+  JPH::JobSystemThreadPool job_system(JPH::cMaxPhysicsJobs,
+                                      JPH::cMaxPhysicsBarriers,
+                                      static_cast<int>(num_threads));
+
+  // One untimed warm-up call first, so thread pool start-up and the cold
+  // cache of the first pass do not count against whichever row runs first
+  auto time_ms = [&](const auto& fn) {
+    fn();
+    const auto t_start = std::chrono::steady_clock::now();
+    for (JPH::uint i = 0; i < kNumIterations; i++) {
+      fn();
+    }
+    const auto t_end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(t_end - t_start).count() /
+           kNumIterations;
+  };
+
+  // Batched variants, separating the effect of the spatial sort from that of
+  // the thread pool
+  struct BatchVariant {
+    const char* name;
+    JPH::JobSystem* job_system;
+    bool sort_spatially;
+  };
+  const BatchVariant kBatchVariants[] = {
+      {"batch, 1 thread, unsorted", nullptr, false},
+      {"batch, 1 thread, sorted", nullptr, true},
+      {"batch, pool, unsorted", &job_system, false},
+      {"batch, pool, sorted", &job_system, true},
+  };
+
+  std::cout << "threads: " << job_system.GetMaxConcurrency() << std::endl;
+  bool ok = true;
+
+  // Rays
+  std::vector<JPH::RayCastResult> vec_ray_hit_single(kNumRays);
+  std::vector<JPH::RayCastResult> vec_ray_hit_batch(kNumRays);
+  const double ms_ray_single = time_ms([&]() {
+    for (JPH::uint i = 0; i < kNumRays; i++) {
+      vec_ray_hit_single[i] = JPH::RayCastResult();
+      narrow_phase_query.CastRay(vec_ray[i], vec_ray_hit_single[i], bplf, olf);
+    }
+  });
+  JPH::uint num_ray_hits = 0;
+  for (const auto& hit : vec_ray_hit_single) {
+    num_ray_hits += hit.mBodyID.IsInvalid() ? 0 : 1;
+  }
+  ok = ok && num_ray_hits > 0;
+  std::cout << "rays: " << kNumRays << " hits: " << num_ray_hits << std::endl;
+  std::cout << "  single: " << ms_ray_single << " ms" << std::endl;
+  for (const auto& variant : kBatchVariants) {
+    BatchQuerySettings batch_settings;
+    batch_settings.sort_spatially = variant.sort_spatially;
+    const double ms_ray_batch = time_ms([&]() {
+      batch_cast_ray(narrow_phase_query, vec_ray.data(), kNumRays,
+                     vec_ray_hit_batch.data(), variant.job_system,
+                     batch_settings, bplf, olf);
+    });
+    JPH::uint num_ray_mismatches = 0;
+    for (JPH::uint i = 0; i < kNumRays; i++) {
+      const auto& single = vec_ray_hit_single[i];
+      const auto& batch = vec_ray_hit_batch[i];
+      if (single.mBodyID != batch.mBodyID ||
+          single.mFraction != batch.mFraction) {
+        num_ray_mismatches++;
+      }
+    }
+    ok = ok && num_ray_mismatches == 0;
+    std::cout << "  " << variant.name << ": " << ms_ray_batch << " ms"
+              << " mismatches: " << num_ray_mismatches << std::endl;
+  }
+
+  // Capsule casts
+  std::vector<JPH::ShapeCastResult> vec_cast_hit_single(kNumCasts);
+  std::vector<JPH::ShapeCastResult> vec_cast_hit_batch(kNumCasts);
+  const double ms_cast_single = time_ms([&]() {
+    for (JPH::uint i = 0; i < kNumCasts; i++) {
+      JPH::ClosestHitCollisionCollector<JPH::CastShapeCollector> collector;
+      narrow_phase_query.CastShape(
+          vec_cast[i], shape_cast_settings,
+          vec_cast[i].mCenterOfMassStart.GetTranslation(), collector, bplf,
+          olf);
+      vec_cast_hit_single[i] =
+          collector.HadHit() ? collector.mHit : JPH::ShapeCastResult();
+    }
+  });
+  JPH::uint num_cast_hits = 0;
+  for (const auto& hit : vec_cast_hit_single) {
+    num_cast_hits += hit.mBodyID2.IsInvalid() ? 0 : 1;
+  }
+  ok = ok && num_cast_hits > 0;
+  std::cout << "casts: " << kNumCasts << " hits: " << num_cast_hits
+            << std::endl;
+  std::cout << "  single: " << ms_cast_single << " ms" << std::endl;
+  for (const auto& variant : kBatchVariants) {
+    BatchQuerySettings batch_settings;
+    batch_settings.sort_spatially = variant.sort_spatially;
+    const double ms_cast_batch = time_ms([&]() {
+      batch_cast_shape(narrow_phase_query, vec_cast.data(), kNumCasts,
+                       shape_cast_settings, vec_cast_hit_batch.data(),
+                       variant.job_system, batch_settings, bplf, olf);
+    });
+    JPH::uint num_cast_mismatches = 0;
+    for (JPH::uint i = 0; i < kNumCasts; i++) {
+      const auto& single = vec_cast_hit_single[i];
+      const auto& batch = vec_cast_hit_batch[i];
+      if (single.mBodyID2 != batch.mBodyID2 ||
+          single.mFraction != batch.mFraction) {
+        num_cast_mismatches++;
+      }
+    }
+    ok = ok && num_cast_mismatches == 0;
+    std::cout << "  " << variant.name << ": " << ms_cast_batch << " ms"
+              << " mismatches: " << num_cast_mismatches << std::endl;
+  }
+
+  std::cout << (ok ? "checks passed" : "checks FAILED") << std::endl;
+  return ok;
+}
+
+// Character update LOD benchmark (run with --bench-character-lod)
+
+// Crowd on the test ground, mostly standing still with a few walking in
+// circles, and one interest point at the repro character's start position.
+// A kinematic sphere sweeps back and forth over one row of the crowd, a
+// sleeping box rests between others, and some characters start walking
+// halfway through. Timed once with ExtendedUpdate on every character every
+// frame and once through CharacterUpdateScheduler, which is checked to:
+// - keep characters under the moving sphere at kEveryFrame
+// - promote idle characters out of kIdle on the frame they start walking
+// - ignore the sleeping box, so characters around it still end up kIdle
+// Returns false if any check fails.
+bool run_character_lod_benchmark(JPH::PhysicsSystem& physics_system,
+                                 JPH::TempAllocator& temp_allocator,
+                                 JPH::JobSystem& job_system) {
+  const JPH::uint kGridX = 20;
+  const JPH::uint kGridY = 20;
+  const JPH::uint kWalkEvery = 8;  // every 8th character walks
+  const JPH::uint kStartWalkOffset = 4;  // ... and these start walking later
+  const float kWalkSpeed = 2.0f;
+  const size_t kMaxNumSteps = 300;
+  const size_t kStartWalkStep = 200;
+  const JPH::uint kCollisionSteps = 1;
+
+  // The sphere flies above the heads of row 2, the box sits between rows 10
+  // and 11 of columns 13 and 14
+  const float kMoverHeight = 4.0f;
+  const float kMoverY = -35.0f + 3.5f * 2;
+  const JPH::RVec3 p_sleeper(47.5f, 1.75f, 0.3f);
+  // Horizontal distances for the checks: well within the scheduler's default
+  // dynamic_body_distance for the sphere, and covering the four characters
+  // around the box
+  const float kMoverCheckDistance = 2.0f;
+  const float kSleeperCheckDistance = 4.0f;
+  auto mover_position = [&](float time) {
+    return JPH::RVec3(20.0f * JPH::Sin(0.2f * time), kMoverY, kMoverHeight);
+  };
+
+  const auto settings_cv = test_character_virtual_settings();
+  const auto settings_eu = test_extended_update_settings();
+  const auto bplf =
+      physics_system.GetDefaultBroadPhaseLayerFilter(ObjectLayerImpl::kDynamic);
+  const auto olf =
+      physics_system.GetDefaultLayerFilter(ObjectLayerImpl::kDynamic);
+  const JPH::SpecifiedBroadPhaseLayerFilter dynamic_bplf(
+      BroadPhaseLayerImpl::kDynamic);
+  const JPH::SpecifiedObjectLayerFilter dynamic_olf(ObjectLayerImpl::kDynamic);
+  JPH::BodyInterface& body_interface = physics_system.GetBodyInterface();
+
+  auto create_crowd = [&]() {
+    std::vector<JPH::Ref<JPH::CharacterVirtual>> vec_character;
+    for (JPH::uint ix = 0; ix < kGridX; ix++) {
+      for (JPH::uint iy = 0; iy < kGridY; iy++) {
+        const JPH::RVec3 p(-20.0f + 5.0f * ix, -35.0f + 3.5f * iy, 0.0f);
+        vec_character.emplace_back(new JPH::CharacterVirtual(
+            settings_cv, p, JPH::Quat::sIdentity(), &physics_system));
+      }
+    }
+    return vec_character;
+  };
+
+  auto is_walking = [&](size_t index, size_t num_steps) {
+    return index % kWalkEvery == 0 ||
+           (index % kWalkEvery == kStartWalkOffset &&
+            num_steps >= kStartWalkStep);
+  };
+
+  // Same pattern as test_character_set_linear_velocity(): gravity is added
+  // every frame, also on ground
+  auto set_linear_velocity = [&](JPH::CharacterVirtual* character_virtual,
+                                 size_t index, size_t num_steps,
+                                 float delta_time) {
+    JPH::Vec3 linear_velocity = character_virtual->GetGroundVelocity();
+    if (character_virtual->GetGroundState() !=
+        JPH::CharacterVirtual::EGroundState::OnGround) {
+      linear_velocity =
+          JPH::Vec3(0.0f, 0.0f, character_virtual->GetLinearVelocity().GetZ());
+    }
+    if (is_walking(index, num_steps)) {
+      const float angle =
+          0.5f * num_steps * delta_time + static_cast<float>(index);
+      linear_velocity += kWalkSpeed * JPH::Vec3(JPH::Cos(angle),
+                                                JPH::Sin(angle), 0.0f);
+    }
+    linear_velocity += physics_system.GetGravity() * delta_time;
+    character_virtual->SetLinearVelocity(linear_velocity);
+  };
+
+  // Runs the crowd with the moving sphere and sleeping box present.
+  // fn_update(num_steps) updates the characters and is the only timed part;
+  // fn_check(num_steps, p_mover) runs right after it.
+  const float delta_time = test_delta_time();
+  auto run_crowd = [&](const auto& fn_update, const auto& fn_check) {
+    const JPH::BodyID id_mover = body_interface.CreateAndAddBody(
+        JPH::BodyCreationSettings(new JPH::SphereShape(0.5f),
+                                  mover_position(0.0f), JPH::Quat::sIdentity(),
+                                  JPH::EMotionType::Kinematic,
+                                  ObjectLayerImpl::kDynamic),
+        JPH::EActivation::Activate);
+    const JPH::BodyID id_sleeper = body_interface.CreateAndAddBody(
+        JPH::BodyCreationSettings(
+            new JPH::BoxShape(JPH::Vec3::sReplicate(0.3f)), p_sleeper,
+            JPH::Quat::sIdentity(), JPH::EMotionType::Dynamic,
+            ObjectLayerImpl::kDynamic),
+        JPH::EActivation::DontActivate);
+
+    double ms = 0.0;
+    for (size_t num_steps = 0; num_steps < kMaxNumSteps; num_steps++) {
+      body_interface.MoveKinematic(
+          id_mover, mover_position((num_steps + 1) * delta_time),
+          JPH::Quat::sIdentity(), delta_time);
+
+      const auto t_start = std::chrono::steady_clock::now();
+      fn_update(num_steps);
+      const auto t_end = std::chrono::steady_clock::now();
+      ms += std::chrono::duration<double, std::milli>(t_end - t_start).count();
+
+      fn_check(num_steps, body_interface.GetCenterOfMassPosition(id_mover));
+      physics_system.Update(delta_time, kCollisionSteps, &temp_allocator,
+                            &job_system);
+    }
+
+    for (const auto id_body : {id_mover, id_sleeper}) {
+      body_interface.RemoveBody(id_body);
+      body_interface.DestroyBody(id_body);
+    }
+    return ms;
+  };
+
+  // Every character every frame
+  const auto vec_character_full = create_crowd();
+  const double ms_full = run_crowd(
+      [&](size_t num_steps) {
+        for (size_t i = 0; i < vec_character_full.size(); i++) {
+          set_linear_velocity(vec_character_full[i], i, num_steps, delta_time);
+          vec_character_full[i]->ExtendedUpdate(
+              delta_time, physics_system.GetGravity(), settings_eu, bplf, olf,
+              {}, {}, temp_allocator);
+        }
+      },
+      [](size_t, JPH::RVec3Arg) {});
+
+  // Scheduled
+  const auto vec_character_lod = create_crowd();
+  CharacterUpdateScheduler scheduler(physics_system, dynamic_bplf,
+                                     dynamic_olf);
+  for (const auto& character_virtual : vec_character_lod) {
+    scheduler.add_character(character_virtual);
+  }
+  scheduler.set_interest_points({test_character_position_initial()});
+
+  auto horizontal_distance = [](JPH::RVec3Arg p1, JPH::RVec3Arg p2) {
+    const JPH::Vec3 delta(p1 - p2);
+    return JPH::Vec3(delta.GetX(), delta.GetY(), 0.0f).Length();
+  };
+
+  const CharacterUpdateTier kTiers[] = {CharacterUpdateTier::kEveryFrame,
+                                        CharacterUpdateTier::kReduced,
+                                        CharacterUpdateTier::kIdle};
+  const char* const kTierNames[] = {"every frame", "reduced", "idle"};
+  CharacterUpdateTierCounters totals[kNumCharacterUpdateTiers];
+  std::vector<CharacterUpdateTier> vec_tier_before(vec_character_lod.size());
+  JPH::uint num_mover_checks = 0;
+  JPH::uint num_mover_failures = 0;
+  JPH::uint num_starters_idle = 0;
+  JPH::uint num_starter_failures = 0;
+  const double ms_lod = run_crowd(
+      [&](size_t num_steps) {
+        for (size_t i = 0; i < vec_character_lod.size(); i++) {
+          set_linear_velocity(vec_character_lod[i], i, num_steps, delta_time);
+        }
+        scheduler.update(delta_time, physics_system.GetGravity(), settings_eu,
+                         bplf, olf, {}, {}, temp_allocator);
+      },
+      [&](size_t num_steps, JPH::RVec3Arg p_mover) {
+        for (JPH::uint t = 0; t < kNumCharacterUpdateTiers; t++) {
+          const auto& counters = scheduler.get_counters(kTiers[t]);
+          totals[t].num_characters += counters.num_characters;
+          totals[t].num_updated += counters.num_updated;
+          totals[t].num_skipped += counters.num_skipped;
+        }
+        for (size_t i = 0; i < vec_character_lod.size(); i++) {
+          const auto& character_virtual = vec_character_lod[i];
+          const CharacterUpdateTier tier =
+              scheduler.get_tier(character_virtual);
+
+          if (horizontal_distance(character_virtual->GetPosition(),
+                                  p_mover) < kMoverCheckDistance) {
+            num_mover_checks++;
+            if (tier != CharacterUpdateTier::kEveryFrame) {
+              num_mover_failures++;
+            }
+          }
+
+          if (num_steps == kStartWalkStep &&
+              i % kWalkEvery == kStartWalkOffset &&
+              vec_tier_before[i] == CharacterUpdateTier::kIdle) {
+            num_starters_idle++;
+            if (tier == CharacterUpdateTier::kIdle) {
+              num_starter_failures++;
+            }
+          }
+          vec_tier_before[i] = tier;
+        }
+      });
+
+  JPH::uint num_sleeper_neighbours = 0;
+  JPH::uint num_sleeper_failures = 0;
+  for (size_t i = 0; i < vec_character_lod.size(); i++) {
+    const auto& character_virtual = vec_character_lod[i];
+    if (is_walking(i, kMaxNumSteps) ||
+        horizontal_distance(character_virtual->GetPosition(), p_sleeper) >=
+            kSleeperCheckDistance) {
+      continue;
+    }
+    num_sleeper_neighbours++;
+    if (scheduler.get_tier(character_virtual) != CharacterUpdateTier::kIdle) {
+      num_sleeper_failures++;
+    }
+  }
+
+  float max_length_drift = 0.0f;
+  for (size_t i = 0; i < vec_character_full.size(); i++) {
+    const float length_drift = JPH::Vec3(vec_character_lod[i]->GetPosition() -
+                                         vec_character_full[i]->GetPosition())
+                                   .Length();
+    max_length_drift = std::max(max_length_drift, length_drift);
+  }
+
+  std::cout << "characters: " << vec_character_full.size()
+            << " steps: " << kMaxNumSteps << std::endl;
+  std::cout << "every frame: " << ms_full << " ms"
+            << " scheduled: " << ms_lod << " ms" << std::endl;
+  for (JPH::uint t = 0; t < kNumCharacterUpdateTiers; t++) {
+    std::cout << "  " << kTierNames[t]
+              << ": character-frames: " << totals[t].num_characters
+              << " updated: " << totals[t].num_updated
+              << " skipped: " << totals[t].num_skipped << std::endl;
+  }
+  std::cout << "max position drift vs every frame: " << max_length_drift
+            << std::endl;
+
+  const bool ok = num_mover_checks > 0 && num_mover_failures == 0 &&
+                  num_starters_idle > 0 && num_starter_failures == 0 &&
+                  num_sleeper_neighbours > 0 && num_sleeper_failures == 0;
+  std::cout << "under moving body, not every frame: " << num_mover_failures
+            << " of " << num_mover_checks << std::endl;
+  std::cout << "idle starters not promoted on start: " << num_starter_failures
+            << " of " << num_starters_idle << std::endl;
+  std::cout << "next to sleeping body, not idle: " << num_sleeper_failures
+            << " of " << num_sleeper_neighbours << std::endl;
+  std::cout << (ok ? "checks passed" : "checks FAILED") << std::endl;
+  return ok;
+}
+
 // Main logic
 
-int main() {
+int main(int argc, char** argv) {
+  const char* mode = argc > 1 ? argv[1] : "";
+  bool ok = true;
+
   // Set up persistent state
   JPH::RegisterDefaultAllocator();
   JPH::Factory::sInstance = new JPH::Factory();
@@ -633,49 +1127,14 @@ int main() {
   // Finish adding bodies
   physics_system.OptimizeBroadPhase();
 
-  // Set up controller
-  JPH::Ref<JPH::CharacterVirtual> character_virtual;
-  {
-    auto settings = test_character_virtual_settings();
-    character_virtual = new JPH::CharacterVirtual(
-        settings, test_character_position_initial(), JPH::Quat::sIdentity(),
-        &physics_system);
-  }
-
-  // Run simulation for a while
-  JPH::Vec3 p_last = character_virtual->GetPosition();
-  float max_length_delta = 0.0f;
-  const size_t kMaxNumSteps = 100;
-  for (size_t num_steps = 0; num_steps < kMaxNumSteps; num_steps++) {
-    const auto p_this = character_virtual->GetPosition();
-    const auto delta = p_this - p_last;
-    p_last = p_this;
-    const float length_delta = delta.Length();
-    if (length_delta > max_length_delta) {
-      max_length_delta = length_delta;
-    }
-    const char* prefix = length_delta > 0.3f ? ">" : " ";
-    std::cout << prefix << " pos.xy: (" << p_this.GetX() << ", "
-              << p_this.GetY() << ")" << " delta.xy: (" << delta.GetX() << ", "
-              << delta.GetY() << ")" << std::endl;
-
-    const float delta_time = test_delta_time();
-    test_character_set_linear_velocity(character_virtual, delta_time);
-    character_virtual->ExtendedUpdate(
-        delta_time, physics_system.GetGravity(),
-        test_extended_update_settings(),
-        physics_system.GetDefaultBroadPhaseLayerFilter(
-            ObjectLayerImpl::kDynamic),
-        physics_system.GetDefaultLayerFilter(ObjectLayerImpl::kDynamic), {},
-        {}, temp_allocator);
-
-    const JPH::uint kCollisionSteps = 1;
-    physics_system.Update(delta_time, kCollisionSteps, &temp_allocator,
-                          &job_system);
+  if (std::strcmp(mode, "--bench-batch-query") == 0) {
+    ok = run_batch_query_benchmark(physics_system);
+  } else if (std::strcmp(mode, "--bench-character-lod") == 0) {
+    ok = run_character_lod_benchmark(physics_system, temp_allocator,
+                                     job_system);
+  } else {
+    run_character_simulation(physics_system, temp_allocator, job_system);
   }
-  std::cout << std::endl << "max delta: " << max_length_delta << std::endl;
-
-  // Tear down controller -- handled by Ref*
 
   // Remove/destroy bodies
   for (const auto id_body : vec_id_body) {
@@ -687,4 +1146,6 @@ int main() {
   JPH::UnregisterTypes();
   delete JPH::Factory::sInstance;
   JPH::Factory::sInstance = nullptr;
+
+  return ok ? 0 : 1;
 }